@@ -0,0 +1,261 @@
+/* File: spibridge.h
+ *
+ * Userspace interface of the spi-bridge virtual nodes.
+ *
+ * Everything spidev understands (SPI_IOC_*) is forwarded to the backing
+ * device. The ioctls below are handled by the bridge itself and use their
+ * own magic so they can never collide with a forwarded command.
+ */
+
+#ifndef _UAPI_SPIBRIDGE_H
+#define _UAPI_SPIBRIDGE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define SPIBRIDGE_IOC_MAGIC	0xb5
+
+/* SPIBRIDGE_IOC_ESTIMATE_WAIT: how long until this node would be granted */
+struct spibridge_wait_estimate {
+	__u64 wait_ns;		/* predicted queue wait, includes owner_ns */
+	__u64 owner_ns;		/* remaining owner window of another client */
+	__u32 queued;		/* operations holding a ticket, all nodes */
+	__u32 pad;
+};
+
+#define SPIBRIDGE_IOC_ESTIMATE_WAIT	_IOR(SPIBRIDGE_IOC_MAGIC, 1, struct spibridge_wait_estimate)
+
+/*
+ * SPIBRIDGE_IOC_MESSAGE_TS: SPI_IOC_MESSAGE(n_xfers) on the transfers at
+ * xfers, plus timestamps taken inside the bridge. t_start/t_end bracket the
+ * forwarded operation (the final attempt when a CRC retry happened).
+ * clockid is CLOCK_MONOTONIC (default when 0 is passed) or CLOCK_TAI.
+ * Returns the number of bytes transferred, like SPI_IOC_MESSAGE.
+ */
+struct spibridge_ts_message {
+	__u64 xfers;		/* struct spi_ioc_transfer[n_xfers] */
+	__u32 n_xfers;
+	__u32 clockid;
+	__u64 t_enqueue;	/* out: call entered the queue */
+	__u64 t_grant;		/* out: queue granted */
+	__u64 t_start;		/* out: transfer handed to the controller */
+	__u64 t_end;		/* out: transfer completed */
+};
+
+#define SPIBRIDGE_IOC_MESSAGE_TS	_IOWR(SPIBRIDGE_IOC_MAGIC, 2, struct spibridge_ts_message)
+
+/*
+ * SPIBRIDGE_IOC_SET_SESSION: files carrying the same non-zero token share
+ * one owner window, across threads, processes and nodes of a bridge.
+ * 0 returns the file to the bridge's owner_scope.
+ */
+#define SPIBRIDGE_IOC_SET_SESSION	_IOW(SPIBRIDGE_IOC_MAGIC, 3, __u64)
+
+/*
+ * SPIBRIDGE_IOC_MESSAGE_AT: SPI_IOC_MESSAGE(n_xfers) started at t_target
+ * (CLOCK_MONOTONIC ns). The bridge queues ahead of the target, holds the bus
+ * and hands the message to the controller from an hrtimer. t_error is the
+ * achieved hand-off time minus t_target, i.e. timer latency: the controller
+ * starts the wire transfer after that, from its own message pump, so t_error
+ * does not include the pump's scheduling delay. Needs a backing whose
+ * spi_device the bridge can reach (EOPNOTSUPP otherwise). Returns bytes
+ * transferred.
+ */
+struct spibridge_at_message {
+	__u64 xfers;		/* struct spi_ioc_transfer[n_xfers] */
+	__u32 n_xfers;
+	__u32 pad;
+	__u64 t_target;
+	__u64 t_fire;		/* out: message handed to the controller */
+	__u64 t_end;		/* out: message completed */
+	__s64 t_error;		/* out: t_fire - t_target */
+};
+
+#define SPIBRIDGE_IOC_MESSAGE_AT	_IOWR(SPIBRIDGE_IOC_MAGIC, 4, struct spibridge_at_message)
+
+/*
+ * SPIBRIDGE_IOC_GROUP: start one message on each of several bridges at the
+ * same moment, e.g. to sample ADCs on two controllers together. Every member
+ * names an open node of a different bridge (issue the ioctl on any node).
+ * The bridge takes all grants first, then hands the messages to their
+ * controllers back to back and waits for all of them. Returns 0 or the
+ * first member error; per-member results are written back to the array.
+ * t_fire is the hand-off to each controller: the spread of t_fire is the
+ * hand-off skew only, each controller's message pump then starts its
+ * message on its own schedule. A member on a CRC node whose response CRC
+ * does not match gets status -EBADMSG; there are no retries.
+ */
+#define SPIBRIDGE_GROUP_MAX	8
+
+struct spibridge_group_member {
+	__s32 fd;
+	__u32 n_xfers;
+	__u64 xfers;		/* struct spi_ioc_transfer[n_xfers] */
+	__u64 t_fire;		/* out: message handed to the controller */
+	__u64 t_end;		/* out: message completed */
+	__s32 status;		/* out: bytes transferred or -errno */
+	__u32 pad;
+};
+
+struct spibridge_group {
+	__u64 members;		/* struct spibridge_group_member[n_members] */
+	__u32 n_members;
+	__u32 pad;
+};
+
+#define SPIBRIDGE_IOC_GROUP		_IOW(SPIBRIDGE_IOC_MAGIC, 5, struct spibridge_group)
+
+/*
+ * SPIBRIDGE_IOC_TRANSACTION: run one message on each of several bridges as
+ * a unit that no other client can interleave with. Grants are taken in a
+ * fixed global order, so concurrent transactions cannot deadlock, against
+ * a single timeout for the whole set (0 uses each bridge's timeout_ms).
+ * When it passes, every grant already taken is released at once and the
+ * pending ticket is abandoned, so the other bridges are not held while it
+ * drains. The messages then run one after the other in array order, with
+ * each node's response CRC check and retries, and all grants are released
+ * together. Unlike a group, any backing works. Returns 0 or the first
+ * member error; members after a failure report -ECANCELED.
+ */
+#define SPIBRIDGE_TXN_MAX	SPIBRIDGE_GROUP_MAX
+
+struct spibridge_txn_member {
+	__s32 fd;
+	__u32 n_xfers;
+	__u64 xfers;		/* struct spi_ioc_transfer[n_xfers] */
+	__s32 status;		/* out: bytes transferred or -errno */
+	__u32 pad;
+};
+
+struct spibridge_txn {
+	__u64 members;		/* struct spibridge_txn_member[n_members] */
+	__u32 n_members;
+	__u32 timeout_ms;
+};
+
+#define SPIBRIDGE_IOC_TRANSACTION	_IOW(SPIBRIDGE_IOC_MAGIC, 6, struct spibridge_txn)
+
+/*
+ * SPIBRIDGE_IOC_HINT: announce the caller's next transfer after the one it
+ * just finished. next_us holds the owner window that long (capped by the
+ * hint_max_us parameter) instead of owner_hold_ms; SPIBRIDGE_HINT_LAST, or
+ * next_us 0, ends the window at once so the next client is granted now.
+ * EBUSY if no transfer finished since the last hold or another client holds
+ * the window.
+ */
+#define SPIBRIDGE_HINT_LAST	(1U << 0)
+
+struct spibridge_hint {
+	__u32 next_us;
+	__u32 flags;
+};
+
+#define SPIBRIDGE_IOC_HINT		_IOW(SPIBRIDGE_IOC_MAGIC, 7, struct spibridge_hint)
+
+/*
+ * SPIBRIDGE_IOC_REGISTER_BUFFERS: pin up to SPIBRIDGE_FIXED_MAX buffers of
+ * up to 1 MiB each for this file, replacing any earlier set (n_bufs 0 just
+ * drops it). They stay pinned until replaced or the file is closed.
+ *
+ * SPIBRIDGE_IOC_MESSAGE_FIXED: SPI_IOC_MESSAGE(n_xfers) whose tx_buf/rx_buf
+ * are SPIBRIDGE_FIXED_REF(index, offset) into the registered set, or 0.
+ * Returns bytes transferred.
+ *
+ * A buffer flagged SPIBRIDGE_BUF_TX_ONLY is pinned read-only, so read-only
+ * mappings (e.g. .rodata) can be registered; using it as rx fails (EINVAL).
+ */
+#define SPIBRIDGE_FIXED_MAX	16
+#define SPIBRIDGE_FIXED_REF(index, offset) \
+	((((__u64)(index) + 1) << 32) | (__u32)(offset))
+
+#define SPIBRIDGE_BUF_TX_ONLY	(1U << 0)
+
+struct spibridge_buf {
+	__u64 addr;
+	__u64 len;
+	__u32 flags;		/* SPIBRIDGE_BUF_* */
+	__u32 pad;
+};
+
+struct spibridge_buf_reg {
+	__u64 bufs;		/* struct spibridge_buf[n_bufs] */
+	__u32 n_bufs;
+	__u32 pad;
+};
+
+struct spibridge_fixed_message {
+	__u64 xfers;		/* struct spi_ioc_transfer[n_xfers] */
+	__u32 n_xfers;
+	__u32 pad;
+};
+
+#define SPIBRIDGE_IOC_REGISTER_BUFFERS	_IOW(SPIBRIDGE_IOC_MAGIC, 8, struct spibridge_buf_reg)
+#define SPIBRIDGE_IOC_MESSAGE_FIXED	_IOW(SPIBRIDGE_IOC_MAGIC, 9, struct spibridge_fixed_message)
+
+/*
+ * SPIBRIDGE_IOC_IMPORT_DMABUF: append a dma-buf (V4L2, udmabuf, DRM, ...) to
+ * this file's registered buffer set. Returns its index and size; refer to it
+ * with SPIBRIDGE_FIXED_REF(index, offset) in SPIBRIDGE_IOC_MESSAGE_FIXED.
+ * The import holds a reference until the set is replaced or the file closed.
+ * SPIBRIDGE_IOC_MESSAGE_FIXED waits for the buffer's fences first: pending
+ * writers before it is sent, all pending users before it is received into.
+ */
+struct spibridge_dmabuf_import {
+	__s32 fd;
+	__u32 index;		/* out */
+	__u64 len;		/* out */
+};
+
+#define SPIBRIDGE_IOC_IMPORT_DMABUF	_IOWR(SPIBRIDGE_IOC_MAGIC, 10, struct spibridge_dmabuf_import)
+
+/*
+ * SPIBRIDGE_IOC_POLL_SETUP: the bridge runs SPI_IOC_MESSAGE(n_xfers) every
+ * period_us itself and compares cmp_len big-endian bytes at cmp_off of the
+ * message data (all transfers in order), ANDed with mask (0 = all cmp_len
+ * bytes). The client is woken (EPOLLPRI, and the eventfd if given) only
+ * when a rule in flags fires, on the first result, and when transfers start
+ * or stop failing.
+ * tx data is taken once at setup. period_us 0 stops polling; a new setup
+ * replaces the previous one.
+ *
+ * SPIBRIDGE_IOC_POLL_READ: the last reported result; clears EPOLLPRI.
+ */
+#define SPIBRIDGE_POLL_CHANGE	(1U << 0)	/* value moved by at least delta since last reported */
+#define SPIBRIDGE_POLL_ABOVE	(1U << 1)	/* value rose above high */
+#define SPIBRIDGE_POLL_BELOW	(1U << 2)	/* value fell below low */
+#define SPIBRIDGE_POLL_SIGNED	(1U << 3)	/* compare as a signed cmp_len-byte value */
+#define SPIBRIDGE_POLL_ERROR	(1U << 4)	/* events only: the transfer failed */
+
+#define SPIBRIDGE_POLL_MAX_XFERS	4
+#define SPIBRIDGE_POLL_MIN_US		100
+
+struct spibridge_poll_setup {
+	__u64 xfers;		/* struct spi_ioc_transfer[n_xfers] */
+	__u32 n_xfers;
+	__u32 period_us;
+	__u32 flags;
+	__u16 cmp_off;
+	__u16 cmp_len;		/* 1..8 */
+	__u64 mask;
+	__u64 delta;
+	__s64 low;
+	__s64 high;
+	__s32 eventfd;		/* -1 for none */
+	__u32 pad;
+};
+
+struct spibridge_poll_result {
+	__u64 buf;		/* receives the message data, may be 0 */
+	__u32 len;		/* in: size of buf, out: bytes written */
+	__u32 events;		/* out: SPIBRIDGE_POLL_* that fired */
+	__u64 seq;		/* out: number of reported results */
+	__u64 t_ns;		/* out: CLOCK_MONOTONIC end of the transfer */
+	__s64 value;		/* out: compared value */
+	__s32 status;		/* out: 0 or the transfer's -errno */
+	__u32 pad;
+};
+
+#define SPIBRIDGE_IOC_POLL_SETUP	_IOW(SPIBRIDGE_IOC_MAGIC, 11, struct spibridge_poll_setup)
+#define SPIBRIDGE_IOC_POLL_READ		_IOWR(SPIBRIDGE_IOC_MAGIC, 12, struct spibridge_poll_result)
+
+#endif /* _UAPI_SPIBRIDGE_H */
@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spibridge-bench: periodic real-time client jitter over a bridge node.
+ *
+ * One SCHED_FIFO thread wakes every period on an absolute CLOCK_MONOTONIC
+ * timeline (like cyclictest) and issues SPIBRIDGE_IOC_MESSAGE_TS, while
+ * background threads keep other nodes of the same bridge busy. Meant to run
+ * against the mock backing (backing=/dev/spibridge-mock mock=1), so the
+ * numbers show what the bridge adds, not what a controller does.
+ *
+ * Per cycle it records:
+ *   wakeup    actual wakeup - programmed wakeup
+ *   wait      t_grant - actual wakeup (syscall entry, admission and queueing)
+ *   service   t_end - t_grant (execution on the backing)
+ *   overrun   t_end - next programmed wakeup (positive = period missed)
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/spi/spidev.h>
+
+#include "spibridge.h"
+
+#define NSEC_PER_SEC	1000000000LL
+#define MAX_LOAD	16
+
+struct load {
+	pthread_t thread;
+	const char *dev;
+	int fd;
+	unsigned long ops;
+};
+
+static volatile sig_atomic_t stop;
+static unsigned int load_bytes = 4096;
+static int load_ioctl;
+
+static int64_t ts_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static void ns_ts(int64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_ns(&ts);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* Background client: back-to-back transfers of load_bytes on its own node */
+static void *load_run(void *arg)
+{
+	struct load *l = arg;
+	uint8_t *buf = calloc(1, load_bytes);
+	struct spi_ioc_transfer x = {
+		.tx_buf = (uintptr_t)buf,
+		.rx_buf = (uintptr_t)buf,
+		.len = load_bytes,
+	};
+	int ret;
+
+	if (!buf)
+		return NULL;
+
+	while (!stop) {
+		if (load_ioctl)
+			ret = ioctl(l->fd, SPI_IOC_MESSAGE(1), &x);
+		else
+			ret = write(l->fd, buf, load_bytes);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			fprintf(stderr, "%s: %s\n", l->dev, strerror(errno));
+			break;
+		}
+		l->ops++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts v in place */
+static void report(const char *name, int64_t *v, size_t n)
+{
+	double sum = 0;
+	size_t i;
+
+	if (!n) {
+		printf("%-8s %8s\n", name, "-");
+		return;
+	}
+
+	qsort(v, n, sizeof(*v), cmp_i64);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+
+	printf("%-8s %8zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, n,
+	       v[0] / 1e3, sum / n / 1e3, v[n / 2] / 1e3, v[n * 99 / 100] / 1e3,
+	       v[n * 999 / 1000] / 1e3, v[n - 1] / 1e3);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] DEVICE\n"
+		"  -i US      period (default 1000)\n"
+		"  -l N       cycles (default 10000, 0 = until interrupted)\n"
+		"  -s BYTES   periodic transfer length (default 4)\n"
+		"  -p PRIO    SCHED_FIFO priority of the periodic thread (default 80, 0 = SCHED_OTHER)\n"
+		"  -b DEVICE  background load node, repeat for more (up to %d)\n"
+		"  -B BYTES   background transfer length (default 4096)\n"
+		"  -I         background load uses SPI_IOC_MESSAGE instead of write()\n",
+		prog, MAX_LOAD);
+}
+
+int main(int argc, char **argv)
+{
+	struct load loads[MAX_LOAD];
+	unsigned int n_load = 0, period_us = 1000, len = 4, i;
+	unsigned long loops = 10000, n = 0, overruns = 0, cap;
+	int prio = 80, opt, fd, ret = 0;
+	int64_t *wake, *wait, *service, *over;
+	int64_t next, period;
+	uint8_t *buf;
+	struct spi_ioc_transfer x = { 0 };
+	struct spibridge_ts_message m = { 0 };
+	struct sched_param sp = { 0 };
+	struct timespec ts;
+
+	while ((opt = getopt(argc, argv, "i:l:s:p:b:B:Ih")) != -1) {
+		switch (opt) {
+		case 'i': period_us = strtoul(optarg, NULL, 0); break;
+		case 'l': loops = strtoul(optarg, NULL, 0); break;
+		case 's': len = strtoul(optarg, NULL, 0); break;
+		case 'p': prio = atoi(optarg); break;
+		case 'b':
+			if (n_load == MAX_LOAD) {
+				usage(argv[0]);
+				return 2;
+			}
+			loads[n_load++].dev = optarg;
+			break;
+		case 'B': load_bytes = strtoul(optarg, NULL, 0); break;
+		case 'I': load_ioctl = 1; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+	if (optind != argc - 1 || !period_us || !len || !load_bytes) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	/* Without a cycle limit keep the last minute or so of samples */
+	cap = loops ? loops : 60UL * 1000000 / period_us + 1;
+	wake = calloc(cap, sizeof(*wake));
+	wait = calloc(cap, sizeof(*wait));
+	service = calloc(cap, sizeof(*service));
+	over = calloc(cap, sizeof(*over));
+	buf = calloc(1, len);
+	if (!wake || !wait || !service || !over || !buf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	x.tx_buf = (uintptr_t)buf;
+	x.rx_buf = (uintptr_t)buf;
+	x.len = len;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	for (i = 0; i < n_load; i++) {
+		loads[i].fd = open(loads[i].dev, O_RDWR);
+		loads[i].ops = 0;
+		if (loads[i].fd < 0) {
+			perror(loads[i].dev);
+			return 1;
+		}
+		if (pthread_create(&loads[i].thread, NULL, load_run, &loads[i])) {
+			fprintf(stderr, "cannot start load thread\n");
+			return 1;
+		}
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		perror("mlockall");
+	if (prio > 0) {
+		sp.sched_priority = prio;
+		if (sched_setscheduler(0, SCHED_FIFO, &sp))
+			perror("SCHED_FIFO");
+	}
+
+	period = (int64_t)period_us * 1000;
+	next = now_ns() + period;
+
+	while (!stop && (!loops || n < loops)) {
+		unsigned long k = n % cap;
+		int64_t woke;
+
+		ns_ts(next, &ts);
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+			continue;
+		woke = now_ns();
+
+		m.xfers = (uintptr_t)&x;
+		m.n_xfers = 1;
+		m.clockid = CLOCK_MONOTONIC;
+		if (ioctl(fd, SPIBRIDGE_IOC_MESSAGE_TS, &m) < 0) {
+			perror("SPIBRIDGE_IOC_MESSAGE_TS");
+			ret = 1;
+			break;
+		}
+
+		wake[k] = woke - next;
+		wait[k] = (int64_t)m.t_grant - woke;
+		service[k] = (int64_t)m.t_end - (int64_t)m.t_grant;
+		next += period;
+		over[k] = (int64_t)m.t_end - next;
+		if (over[k] > 0) {
+			overruns++;
+			/* Skip the missed periods instead of bursting to catch up */
+			while (next <= (int64_t)m.t_end)
+				next += period;
+		}
+		n++;
+	}
+
+	stop = 1;
+	for (i = 0; i < n_load; i++) {
+		pthread_join(loads[i].thread, NULL);
+		close(loads[i].fd);
+	}
+
+	if (n > cap)
+		n = cap;
+	printf("%lu cycles at %u us, %u bytes, %u load threads x %u bytes (%s), %lu overruns\n",
+	       n, period_us, len, n_load, load_bytes, load_ioctl ? "ioctl" : "write", overruns);
+	for (i = 0; i < n_load; i++)
+		printf("  %s: %lu ops\n", loads[i].dev, loads[i].ops);
+	printf("%-8s %8s %9s %9s %9s %9s %9s %9s  (us)\n",
+	       "", "samples", "min", "avg", "p50", "p99", "p99.9", "max");
+	report("wakeup", wake, n);
+	report("wait", wait, n);
+	report("service", service, n);
+	report("overrun", over, n);
+
+	close(fd);
+	return ret;
+}